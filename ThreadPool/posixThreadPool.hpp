@@ -8,14 +8,22 @@
 #include <unistd.h>
 #include <iostream>
 #include <exception>
+#include "../logger/logger.h"
 /*
 mind：采用posix pthread接口创建线程，也可以用c++ thread类代替。
 线程池的优点是减少了创建和销毁线程带来的开销，缺点是线程池会长期占用一部分资源。
 线程池维护多个线程，线程不断访问队列获取需要执行的工作，常用于http服务器为新连接提供服务。
 线程池接受模板类，模板类需要实现process函数作为工作函数
+析构时工作线程先处理完队列中剩余的任务再退出，append成功的任务都会被process
 */
 #define MAXTHREADS 128
 
+inline logChannel *threadPoolLog()
+{
+    static logChannel *channel = logger::getInstance()->getChannel("posixThreadPool");
+    return channel;
+}
+
 template <typename T>
 struct threadInfo
 {
@@ -77,7 +85,7 @@ posixThreadPool<T>::~posixThreadPool()
     for(auto &tid : workThread)
     {
         pthread_join(tid, NULL);
-        std::cout << "thread with tid " << tid << " has joined\n";
+        LOGM_DEBUG(threadPoolLog(), "event=join tid=%lu", (unsigned long)tid)
     }
 }
 
@@ -90,7 +98,7 @@ void *posixThreadPool<T>::worker(void *args)
     {
         p->self->run(number);
     }
-    std::cout << "thread " << number << " with tid " << pthread_self() << " exit\n";
+    LOGM_DEBUG(threadPoolLog(), "event=exit worker=%d tid=%lu", number, (unsigned long)pthread_self())
     usleep(100000);
     if(p)
     {
@@ -102,7 +110,9 @@ void *posixThreadPool<T>::worker(void *args)
 template <typename T>
 void posixThreadPool<T>::run(int number)
 {
-    while(!stop)
+    (void)number;//only read by the debug log
+    //after stop is set the workers still finish whatever is queued, every appended task gets its process() call
+    while(true)
     {
         std::unique_lock<std::mutex> unique(mt);
         while(this->workQueue.empty())
@@ -114,9 +124,11 @@ void posixThreadPool<T>::run(int number)
             }
             this->condition.wait(unique);
         }
-        std::cout << "thread " << number << " is running\n";
+        LOGM_DEBUG(threadPoolLog(), "event=run worker=%d", number)
         T *task = this->workQueue.front();
         this->workQueue.pop();
+        //let other workers take tasks while this one is processing
+        unique.unlock();
         if(task)
         {
             task->process();
@@ -134,6 +146,8 @@ bool posixThreadPool<T>::append(T *task)
         workQueue.push(task);
         unique.unlock();
         condition.notify_one();
+        return true;
     }
+    return false;
 }
 #endif
\ No newline at end of file
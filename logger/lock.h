@@ -0,0 +1,40 @@
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include <pthread.h>
+#include <exception>
+/*
+mind:对pthread互斥锁的简单封装，logger用它保护日志文件和单条日志缓冲
+*/
+
+class locker
+{
+    public:
+        locker()
+        {
+            if(pthread_mutex_init(&m_mutex, NULL) != 0)
+                throw std::exception();
+        }
+        ~locker()
+        {
+            pthread_mutex_destroy(&m_mutex);
+        }
+        bool lock()
+        {
+            return pthread_mutex_lock(&m_mutex) == 0;
+        }
+        bool unlock()
+        {
+            return pthread_mutex_unlock(&m_mutex) == 0;
+        }
+        pthread_mutex_t *get()
+        {
+            return &m_mutex;
+        }
+    private:
+        locker(const locker&);//不允许拷贝
+        locker& operator=(const locker&);
+        pthread_mutex_t m_mutex;
+};
+
+#endif
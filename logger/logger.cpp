@@ -13,15 +13,43 @@
 #include <string.h>
 #include <errno.h>
 #include "lock.h"
+
+static void formatTime(char *timeStr, size_t size)
+{
+    time_t nowTime;
+    struct tm tmBuf;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    nowTime = tv.tv_sec;
+    localtime_r(&nowTime, &tmBuf);
+    snprintf(timeStr, size, "%04d-%02d-%02d_%02d:%02d:%02d:%03d", tmBuf.tm_year + 1900, tmBuf.tm_mon + 1, tmBuf.tm_mday, tmBuf.tm_hour, tmBuf.tm_min, tmBuf.tm_sec, (int)tv.tv_usec / 1000);
+}
+
 logger::logger()//构造函数私有，不允许构造，使用静态对象
 {
     curLineCount = 0;
     isAsync = 0;
+    initialized = false;
+    fp = NULL;
+    logBuf = NULL;
+    maxQueueSize = 0;
+    droppedCount = 0;
+    asyncExit = false;
 }
 
 
 logger::~logger()//私有虚析构函数，支持派生，限制此类的对象不能是栈对象
 {
+    if(isAsync)
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        asyncExit = true;
+        lock.unlock();
+        queueCond.notify_all();
+        pthread_join(asyncTid, NULL);
+    }
+    //init之前缓存的日志，没有init时写到标准错误
+    flushPending(fp ? fp : stderr);
     if(fp)
     {
         fclose(fp);
@@ -30,28 +58,90 @@ logger::~logger()//私有虚析构函数，支持派生，限制此类的对象
 }
 void *logger::asyncWriteLog()//日志异步写
 {
-    std::string singleLog;
+    std::queue<std::string> batch;
     while(1)
     {
+        //等待新日志，一次取走队列中全部日志，写入期间不阻塞记录日志的线程
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueCond.wait(lock, [this]() { return !logQueue.empty() || asyncExit; });
+        if(logQueue.empty())
+            break;
+        batch.swap(logQueue);
+        lock.unlock();
+
         mutex.lock();
-        if(logQueue.empty())//是否需要在这里加锁
+        rotateLog();
+        while(!batch.empty())
         {
-            mutex.unlock();
-            continue;
+            if(fp)
+            {
+                if(fp != stdout && fp != stderr)
+                    ++curLineCount;
+                fputs(batch.front().c_str(), fp);
+            }
+            batch.pop();
         }
-        singleLog = logQueue.front();//取队首元素
-        logQueue.pop();//弹出
         if(fp)
-        {
-            ++curLineCount;
-            fputs(singleLog.c_str(), fp);
-        }
+            fflush(fp);
         mutex.unlock();
     }
+    return NULL;
+}
+void logger::rotateLog()
+{
+    char timeStr[64];
+    std::string logPathFileName;
+    FILE *file;
+    if(fp == stdout || fp == stderr || curLineCount < maxLogLine)
+        return ;
+    curLineCount = 0;
+    if(fp)
+    {
+        fflush(fp);
+        fclose(fp);
+        fp = NULL;
+    }
+    formatTime(timeStr, sizeof(timeStr));
+    logPathFileName = dirName + '/' + timeStr + "_" + logName;
+    file = fopen(logPathFileName.c_str(), "a");
+    if(!file)
+    {
+        fprintf(stderr, "fopen error :%s, errno = %d\n", strerror(errno), errno);
+        return ;
+    }
+    fp = file;
+}
+void logger::flushPending(FILE *out)
+{
+    std::queue<std::string> pending;
+    std::unique_lock<std::mutex> lock(queueMutex);
+    pending.swap(logQueue);
+    lock.unlock();
+    mutex.lock();
+    while(!pending.empty())
+    {
+        fputs(pending.front().c_str(), out);
+        pending.pop();
+    }
+    fflush(out);
+    mutex.unlock();
+}
+const char *logger::levelName(int level)
+{
+    switch(level)
+    {
+        case LOGGER_INFO:
+            return "INFO";
+        case LOGGER_WARNING:
+            return "WARNING";
+        case LOGGER_ERROR:
+            return "ERROR";
+        default:
+            return "DEBUG";
+    }
 }
 bool logger::init(const char *fileName, unsigned int logOutput, unsigned int logBufSize, unsigned int logLine, unsigned int queueSize)
 {
-    pthread_t tid;
     time_t nowTime;
     struct tm *p;
     char timeStr[64];
@@ -77,25 +167,22 @@ bool logger::init(const char *fileName, unsigned int logOutput, unsigned int log
 
     logBuf = new char[maxLogBufSize];
     
-    if(logOutput == 1)
-    {
-        isAsync = false;
-        fp = stdout;
-        return true;
-    }
-    else if(logOutput == 2)
+    if(logOutput == 1 || logOutput == 2)
     {
+        fp = logOutput == 1 ? stdout : stderr;
         isAsync = false;
-        fp = stderr;
+        if(maxQueueSize)//终端输出同样可以异步，避免业务线程阻塞在终端IO上
+        {
+            isAsync = true;
+            pthread_create(&asyncTid, NULL, asyncLogThread, NULL);//先写出init之前缓存的日志
+        }
+        else
+        {
+            flushPending(fp);
+        }
+        initialized.store(true, std::memory_order_release);
         return true;
     }
-
-    if(maxQueueSize)//开启异步日志记录
-    {
-        isAsync = true;
-        pthread_create(&tid, NULL, asyncLogThread, NULL);//异步日志处理线程，线程是类的成员函数，可以访问类成员，不需要this指针
-        pthread_detach(tid);
-    }
     
     memset(logBuf, 0x0, maxLogBufSize);
     memset(timeStr, 0x0, sizeof(timeStr));            
@@ -138,16 +225,24 @@ bool logger::init(const char *fileName, unsigned int logOutput, unsigned int log
         return false;
     }
     fp = file;
+    if(maxQueueSize)//开启异步日志记录，文件打开之后再启动，init之前缓存的日志不会因fp为空被丢弃
+    {
+        isAsync = true;
+        pthread_create(&asyncTid, NULL, asyncLogThread, NULL);//异步日志处理线程，线程是类的成员函数，可以访问类成员，不需要this指针
+    }
+    else
+    {
+        flushPending(fp);
+    }
+    initialized.store(true, std::memory_order_release);
     return true;
 }
 void logger::writeLog(int level, const char *fileName, const char *func, const int line, const char *format, ...)
 {
     std::string logLevel;
     char timeStr[64];
-    std::string logPathFileName;
     time_t nowTime;
     struct tm *p;
-    FILE *file;
     struct timeval tv;
     switch(level)
     {
@@ -174,27 +269,11 @@ void logger::writeLog(int level, const char *fileName, const char *func, const i
     snprintf(timeStr, sizeof(timeStr), "%04d-%02d-%02d_%02d:%02d:%02d:%03d", p->tm_year + 1900, p->tm_mon + 1, p->tm_mday, p->tm_hour, p->tm_min, p->tm_sec, (int)tv.tv_usec / 1000);
     
     mutex.lock();
-    if(fp != stdout && fp != stderr && curLineCount >= maxLogLine)
+    rotateLog();
+    if(!fp)
     {
-        curLineCount = 0;
-        if(fp)
-        {
-            fflush(fp);
-            fclose(fp);
-            fp = NULL;
-        }
-        logPathFileName = dirName + '/' + timeStr + "_" + logName;
-        file = fopen(logPathFileName.c_str(), "a");
-        if(!file)
-        {
-            fprintf(stderr, "fopen error :%s, errno = %d\n", strerror(errno), errno);
-            mutex.unlock();
-            return ;
-        }
-        else 
-        {
-            fp = file;   
-        }
+        mutex.unlock();
+        return ;
     }
     mutex.unlock();
     
@@ -206,17 +285,101 @@ void logger::writeLog(int level, const char *fileName, const char *func, const i
     logBuf[m + n] = '\0';
     va_end(list);
  
-    mutex.lock();
-    if(isAsync && logQueue.size() < maxQueueSize)
+    if(isAsync)
     {
-        logStr = logBuf;
-        logQueue.push(logStr);
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if(logQueue.size() < (size_t)maxQueueSize)
+        {
+            logStr = logBuf;
+            logQueue.push(logStr);
+            lock.unlock();
+            queueCond.notify_one();
+            return ;
+        }
     }
-    else if(fp) 
+    mutex.lock();
+    if(fp) 
     {
         if(fp != stdout && fp != stderr)
             ++curLineCount;
         fputs(logBuf, fp);
     }
     mutex.unlock();
-}
\ No newline at end of file
+}
+logChannel *logger::getChannel(const char *module)
+{
+    std::unique_lock<std::mutex> lock(channelMutex);
+    auto it = channels.find(module);
+    if(it != channels.end())
+        return it->second;
+    logChannel *channel = new logChannel;
+    channel->name = module;
+    channel->level = LOGGER_INFO;
+    channels[module] = channel;
+    return channel;
+}
+void logger::setModuleLevel(const char *module, int level)
+{
+    getChannel(module)->level = level;
+}
+unsigned long long logger::getDroppedCount()
+{
+    return droppedCount.load();
+}
+void logger::writeModuleLog(logChannel *channel, int level, const char *fileName, const char *func, const int line, const char *format, ...)
+{
+    char timeStr[64];
+    char buf[1024];//模块日志在多个线程中并发调用，不使用共享的logBuf
+    //init之前不读isAsync和fp，日志进入同一个队列，等init选定输出后写出
+    bool ready = initialized.load(std::memory_order_acquire);
+    bool queued = !ready || isAsync;
+    size_t limit = ready ? (size_t)maxQueueSize : LOGGER_PENDING_SIZE;
+    if(queued)
+    {
+        //队列已满时不再格式化，直接丢弃
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if(logQueue.size() >= limit)
+        {
+            ++droppedCount;
+            return ;
+        }
+    }
+
+    formatTime(timeStr, sizeof(timeStr));
+    va_list list;
+    va_start(list, format);
+    int n = snprintf(buf, sizeof(buf), "[%s][%s][%s][%s][%s][%d] ", levelName(level), timeStr, channel->name.c_str(), fileName, func, line);
+    if(n < 0 || n >= (int)sizeof(buf) - 1)
+        n = sizeof(buf) - 2;
+    int m = vsnprintf(buf + n, sizeof(buf) - n - 1, format, list);
+    va_end(list);
+    if(m < 0)
+        m = 0;
+    if(n + m > (int)sizeof(buf) - 2)
+        m = sizeof(buf) - 2 - n;
+    buf[n + m] = '\n';
+    buf[n + m + 1] = '\0';
+
+    if(queued)
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if(logQueue.size() >= limit)
+        {
+            ++droppedCount;
+            return ;
+        }
+        logQueue.push(std::string(buf, n + m + 1));
+        lock.unlock();
+        queueCond.notify_one();
+        return ;
+    }
+    mutex.lock();
+    rotateLog();
+    if(fp)
+    {
+        if(fp != stdout && fp != stderr)
+            ++curLineCount;
+        fputs(buf, fp);
+    }
+    mutex.unlock();
+}
@@ -14,6 +14,11 @@
 #include <errno.h>
 #include "lock.h"
 #include <queue>
+#include <string>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 /*
 mind:日志类对外应该只提供日志输出接口，调用接口可以将日志输出到标准输出或者写入日志文件
 调用者不需要常规的：创建一个日志对象，然后调用对象方法去实现功能。
@@ -25,6 +30,12 @@ mind:日志类对外应该只提供日志输出接口，调用接口可以将日
 4.日志文件命名：日志文件命名和时间绑定
 5.日志文件限制：应该限制单个日志文件大小，以及超过此大小后需要重新生成新的日志文件，并继续记录日志
 6.系统崩溃时日志文件完整性：日志类不具备系统崩溃检测能力，在每次记录完后调用fsync尽可能写入文件。崩溃对异步写入影响较大
+7.模块日志通道：getChannel按模块名返回通道，每个通道有独立的日志级别(setModuleLevel)，级别不够的日志只做一次原子读取就返回
+  模块日志格式为[级别][时间][模块][文件][函数][行] key=value ...，由调用者在format中写入连接号、线程号等字段
+  异步模式下模块日志只进入队列，队列满时丢弃并计数(getDroppedCount)，调用线程不会做同步IO
+  输出到标准输出/标准错误时queueSize不为0也开启异步写
+  init之前的模块日志先缓存在队列中(最多LOGGER_PENDING_SIZE条)，init选定输出后写出；一直没有init时在进程退出时写到标准错误
+  调用模块日志的线程在init前后都不会因此做终端IO(同步模式除外)
 */
 
 #define LOGGER_DEBUG 0
@@ -32,6 +43,8 @@ mind:日志类对外应该只提供日志输出接口，调用接口可以将日
 #define LOGGER_WARNING 2
 #define LOGGER_ERROR 3
 
+#define LOGGER_PENDING_SIZE 1024 //init之前最多缓存的模块日志条数
+
 #define dev_debug(level, format, ...) \
 do {\
     logger::getInstance()->writeLog(level, __FILE__, __FUNCTION__, __LINE__, format, ##__VA_ARGS__);\
@@ -42,12 +55,32 @@ do {\
 #define LOG_WARN(arg...) dev_debug(LOGGER_WARNING, ##arg)
 #define LOG_ERROR(arg...) dev_debug(LOGGER_ERROR, ##arg)
 
+#define dev_module_debug(channel, logLevel, format, ...) \
+do {\
+    if((logLevel) >= (channel)->level.load(std::memory_order_relaxed))\
+        logger::getInstance()->writeModuleLog(channel, logLevel, __FILE__, __FUNCTION__, __LINE__, format, ##__VA_ARGS__);\
+}while(0);
+
+#define LOGM_DEBUG(channel, arg...) dev_module_debug(channel, LOGGER_DEBUG, ##arg)
+#define LOGM_INFO(channel, arg...) dev_module_debug(channel, LOGGER_INFO, ##arg)
+#define LOGM_WARN(channel, arg...) dev_module_debug(channel, LOGGER_WARNING, ##arg)
+#define LOGM_ERROR(channel, arg...) dev_module_debug(channel, LOGGER_ERROR, ##arg)
+
+struct logChannel
+{
+    std::string name;
+    std::atomic<int> level;//records below this level are dropped before formatting
+};
+
 class logger
 {
     private:
         logger();//构造函数私有，不允许构造，使用静态对象
         virtual ~logger();//私有虚析构函数，支持派生，限制此类的对象不能是栈对象
         void *asyncWriteLog();//日志异步写
+        void rotateLog();//当前文件行数超过maxLogLine时新建日志文件，调用前需持有mutex
+        const char *levelName(int level);
+        void flushPending(FILE *out);//写出队列中剩余的日志，同步模式init结束时和析构时调用
     private:
         std::string dirName;//日志文件位置
         std::string logName;//日志文件名
@@ -59,7 +92,15 @@ class logger
         std::queue<std::string> logQueue;//日志缓冲队列
         int maxQueueSize; //缓冲队列元素个数
         bool isAsync; //是否异步记录日志
+        std::atomic<bool> initialized;//init成功后以release写入，模块日志先acquire读取，之后才读isAsync和fp
         locker mutex;
+        std::mutex queueMutex;//保护logQueue
+        std::condition_variable queueCond;//唤醒异步写线程
+        pthread_t asyncTid;
+        bool asyncExit;//析构时通知异步写线程写完剩余日志后退出
+        std::mutex channelMutex;//保护channels
+        std::map<std::string, logChannel *> channels;//模块通道，创建后不释放，指针长期有效
+        std::atomic<unsigned long long> droppedCount;//队列满时丢弃的日志数
     public:
         static logger *getInstance()//返回一个静态实例
         {
@@ -69,9 +110,14 @@ class logger
         static void *asyncLogThread(void *args)//异步记录工作线程
         {
             logger::getInstance()->asyncWriteLog();
+            return NULL;
         }
         bool init(const char *fileName, unsigned int logOutput = 1, unsigned int logBufSize = 8192, unsigned int logLine = 50000000, unsigned int queueSize = 0);
         void writeLog(int level, const char *fileName, const char *func, const int line, const char *format, ...);
+        logChannel *getChannel(const char *module);//不存在时以LOGGER_INFO级别创建
+        void setModuleLevel(const char *module, int level);
+        void writeModuleLog(logChannel *channel, int level, const char *fileName, const char *func, const int line, const char *format, ...);
+        unsigned long long getDroppedCount();
 
 };
 
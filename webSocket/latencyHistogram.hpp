@@ -0,0 +1,84 @@
+#ifndef __LATENCYHISTOGRAM_HPP__
+#define __LATENCYHISTOGRAM_HPP__
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+
+//log-linear latency histogram in microseconds, 16 sub buckets per power of two, lock-free record
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        for(auto &b : m_buckets)
+            b = 0;
+        m_count = 0;
+        m_max = 0;
+    }
+
+    void record(uint64_t us)
+    {
+        m_buckets[index(us)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        uint64_t cur = m_max.load(std::memory_order_relaxed);
+        while(us > cur && !m_max.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const
+    {
+        return m_count.load();
+    }
+
+    uint64_t max() const
+    {
+        return m_max.load();
+    }
+
+    //upper bound of the bucket holding the p-th percentile, never above the largest recorded value
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = count();
+        if(total == 0)
+            return 0;
+        uint64_t target = (uint64_t)(total * p / 100.0);
+        if(target >= total)
+            target = total - 1;
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; i++)
+        {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if(seen > target)
+                return std::min(upper(i), max());
+        }
+        return max();
+    }
+
+private:
+    static const int SUB = 16;
+    static const int BUCKETS = 64 * SUB;
+    std::atomic<uint64_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_max;
+
+    static int index(uint64_t v)
+    {
+        if(v < SUB)
+            return (int)v;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - 4;
+        int idx = (shift + 1) * SUB + (int)((v >> shift) & (SUB - 1));
+        return idx < BUCKETS ? idx : BUCKETS - 1;
+    }
+
+    static uint64_t upper(int idx)
+    {
+        if(idx < SUB)
+            return idx;
+        int shift = idx / SUB - 1;
+        uint64_t base = (uint64_t)(SUB + idx % SUB) << shift;
+        return base + ((uint64_t)1 << shift) - 1;
+    }
+};
+#endif
@@ -0,0 +1,344 @@
+/*
+WebSocketServer 压力测试/延迟测试工具，全部运行在本机回环地址上，不依赖外部服务
+--mode both   在同一进程内启动WebSocketServer并发起压测(默认)
+--mode server 只启动服务端，每秒打印连接数、收发消息数、事件循环延迟、进程RSS和线程数
+--mode client 只启动压测端，连接本机--port端口，--server-pid 指定服务端进程号用于读取服务端RSS和线程数
+压测端所有连接共享一个io_service，由--io-threads个线程驱动
+每个连接按--rate的频率发送--size字节的回显消息，消息头带发送时间戳，统计往返延迟
+--bcast-rate 大于0时由第一个连接发送广播消息，服务端转发给全部连接，统计广播扇出延迟
+结束时输出建连速率、收发消息速率、延迟分位数、服务端进程RSS和线程数(读取/proc/<pid>/status)，
+--mode both 时服务端和压测端在同一进程内，RSS和线程数是两者之和
+
+build:
+g++ -std=c++11 -O2 webSocketBench.cpp ../logger/logger.cpp -o webSocketBench -lboost_system -lpthread
+测试permessage-deflate时加上 -DWEBSOCKET_PERMESSAGE_DEFLATE -lz
+*/
+#include "webSocketServer.hpp"
+#include "latencyHistogram.hpp"
+#include <websocketpp/config/asio_client.hpp>
+#include <websocketpp/client.hpp>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+typedef websocketpp::client<websocketpp::config::asio_client> benchClient;
+
+struct BenchOptions
+{
+    std::string mode = "both";
+    int port = 9002;
+    int connections = 1000;
+    double rate = 10;//messages per second per connection
+    double bcastRate = 0;//broadcasts per second
+    size_t size = 64;
+    int duration = 10;//seconds
+    int ioThreads = 4;
+    int workers = 4;//server posixThreadPool size
+    int serverPid = 0;//--mode client only, the server process to report VmRSS and Threads for
+};
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//read one "Key:   value" line from /proc/<pid>/status, pid 0 reads this process
+static std::string proc_status(int pid, const std::string& key)
+{
+    std::ifstream in(pid > 0 ? "/proc/" + std::to_string(pid) + "/status" : std::string("/proc/self/status"));
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(line.compare(0, key.size() + 1, key + ":") == 0)
+        {
+            size_t pos = line.find_first_not_of(" \t", key.size() + 1);
+            return pos == std::string::npos ? "" : line.substr(pos);
+        }
+    }
+    return "";
+}
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(const BenchOptions& opt)
+        : m_opt(opt), m_opened(0), m_failed(0), m_sent(0), m_received(0), m_stopping(false)
+    {
+        m_client.set_access_channels(websocketpp::log::alevel::none);
+        m_client.set_error_channels(websocketpp::log::elevel::none);
+        m_client.init_asio(&m_ios);
+        m_client.set_message_handler(std::bind(&LoadGenerator::on_message, this, std::placeholders::_1, std::placeholders::_2));
+    }
+
+    void run()
+    {
+        std::string uri = "ws://127.0.0.1:" + std::to_string(m_opt.port) + "/bench";
+        std::unique_ptr<io_service::work> work(new io_service::work(m_ios));
+        std::vector<std::thread> threads;
+        for(int i = 0; i < m_opt.ioThreads; i++)
+        {
+            threads.emplace_back([this]() { m_ios.run(); });
+        }
+
+        //connect everything first, measure the setup rate
+        uint64_t setupStart = now_ns();
+        for(int i = 0; i < m_opt.connections; i++)
+        {
+            websocketpp::lib::error_code ec;
+            benchClient::connection_ptr con = m_client.get_connection(uri, ec);
+            if(ec)
+            {
+                std::cerr << "get_connection failed: " << ec.message() << std::endl;
+                ++m_failed;
+                continue;
+            }
+            con->set_open_handler(std::bind(&LoadGenerator::on_open, this, i, std::placeholders::_1));
+            con->set_fail_handler(std::bind(&LoadGenerator::on_fail, this, std::placeholders::_1));
+            m_client.connect(con);
+        }
+        while(m_opened + m_failed < (uint64_t)m_opt.connections)
+        {
+            usleep(1000);
+        }
+        double setupSec = (now_ns() - setupStart) / 1e9;
+
+        //drive the configured load
+        uint64_t loadStart = now_ns();
+        for(size_t i = 0; i < m_links.size(); i++)
+        {
+            if(m_links[i])
+                schedule(i);
+        }
+        sleep(m_opt.duration);
+        m_stopping = true;
+        double loadSec = (now_ns() - loadStart) / 1e9;
+        uint64_t sent = m_sent, received = m_received;
+        //the server lives in this process unless it was started separately
+        bool serverKnown = m_opt.mode != "client" || m_opt.serverPid > 0;
+        int serverPid = m_opt.mode == "client" ? m_opt.serverPid : 0;
+        std::string rss = proc_status(serverPid, "VmRSS"), threadNum = proc_status(serverPid, "Threads");
+
+        for(auto &link : m_links)
+        {
+            if(link)
+            {
+                websocketpp::lib::error_code ec;
+                m_client.close(link->hdl, websocketpp::close::status::normal, "bench done", ec);
+            }
+        }
+        work.reset();
+        for(auto &th : threads)
+        {
+            th.join();
+        }
+
+        printf("connections   : %llu opened, %llu failed, %.1f conn/s\n",
+               (unsigned long long)m_opened.load(), (unsigned long long)m_failed.load(), m_opened / setupSec);
+        printf("messages      : %.1f sent/s, %.1f received/s, payload %zu bytes\n", sent / loadSec, received / loadSec, m_opt.size);
+        report("round trip", m_rtt);
+        report("bcast fanout", m_fanout);
+        if(!serverKnown)
+            printf("server process: unknown, pass --server-pid to report its VmRSS and Threads\n");
+        else if(rss.empty())
+            printf("server process: pid %d not readable\n", serverPid);
+        else
+            printf("server process: VmRSS %s, Threads %s%s\n", rss.c_str(), threadNum.c_str(),
+                   m_opt.mode == "both" ? " (server and load generator share the process)" : "");
+    }
+
+private:
+    struct Link
+    {
+        websocketpp::connection_hdl hdl;
+        std::unique_ptr<steady_timer> timer;
+        std::unique_ptr<steady_timer> bcastTimer;
+    };
+
+    BenchOptions m_opt;
+    io_service m_ios;
+    benchClient m_client;
+    std::mutex m_mutex;//guards m_links while connecting
+    std::vector<std::unique_ptr<Link> > m_links;
+    std::atomic<uint64_t> m_opened;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_sent;
+    std::atomic<uint64_t> m_received;
+    std::atomic<bool> m_stopping;
+    LatencyHistogram m_rtt;
+    LatencyHistogram m_fanout;
+
+    //'E' echo or 'B' broadcast, then the send time as 16 hex digits, padded to the payload size
+    std::string make_payload(char type)
+    {
+        char head[32];
+        snprintf(head, sizeof(head), "%c%016llx", type, (unsigned long long)now_ns());
+        std::string payload(head);
+        if(payload.size() < m_opt.size)
+            payload.resize(m_opt.size, 'x');
+        return payload;
+    }
+
+    void schedule(size_t i)
+    {
+        Link &link = *m_links[i];
+        if(m_opt.rate > 0)
+        {
+            arm(link.hdl, *link.timer, (long)(1e6 / m_opt.rate), 'E');
+        }
+        if(i == 0 && m_opt.bcastRate > 0)
+        {
+            arm(link.hdl, *link.bcastTimer, (long)(1e6 / m_opt.bcastRate), 'B');
+        }
+    }
+
+    void arm(websocketpp::connection_hdl hdl, steady_timer& timer, long intervalUs, char type)
+    {
+        timer.expires_after(std::chrono::microseconds(intervalUs));
+        timer.async_wait([this, hdl, &timer, intervalUs, type](const boost::system::error_code& error) {
+            if(error || m_stopping)
+                return ;
+            websocketpp::lib::error_code ec;
+            m_client.send(hdl, make_payload(type), websocketpp::frame::opcode::text, ec);
+            if(!ec)
+                ++m_sent;
+            arm(hdl, timer, intervalUs, type);
+        });
+    }
+
+    void on_open(int index, websocketpp::connection_hdl hdl)
+    {
+        std::unique_ptr<Link> link(new Link);
+        link->hdl = hdl;
+        link->timer.reset(new steady_timer(m_ios));
+        link->bcastTimer.reset(new steady_timer(m_ios));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if(m_links.size() <= (size_t)index)
+            m_links.resize(index + 1);
+        m_links[index] = std::move(link);
+        lock.unlock();
+        ++m_opened;
+    }
+
+    void on_fail(websocketpp::connection_hdl hdl)
+    {
+        ++m_failed;
+    }
+
+    void on_message(websocketpp::connection_hdl hdl, benchClient::message_ptr msg)
+    {
+        const std::string &payload = msg->get_payload();
+        if(payload.size() < 17)
+            return ;
+        ++m_received;
+        uint64_t sentAt = strtoull(payload.substr(1, 16).c_str(), NULL, 16);
+        uint64_t us = (now_ns() - sentAt) / 1000;
+        if(payload[0] == 'B')
+            m_fanout.record(us);
+        else
+            m_rtt.record(us);
+    }
+
+    static void report(const char *name, const LatencyHistogram& h)
+    {
+        if(h.count() == 0)
+            return ;
+        printf("%-14s: n=%llu p50=%lluus p90=%lluus p99=%lluus p99.9=%lluus max=%lluus\n", name,
+               (unsigned long long)h.count(),
+               (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+               (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+               (unsigned long long)h.max());
+    }
+};
+
+//thousands of sockets need a bigger fd limit than the usual 1024
+static void raise_fd_limit()
+{
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [--mode both|server|client] [--port n] [--conns n] [--rate msg/s] [--size bytes]\n"
+           "          [--bcast-rate msg/s] [--duration s] [--io-threads n] [--workers n] [--server-pid pid]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions opt;
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if(arg == "--mode") opt.mode = value;
+        else if(arg == "--port") opt.port = atoi(value.c_str());
+        else if(arg == "--conns") opt.connections = atoi(value.c_str());
+        else if(arg == "--rate") opt.rate = atof(value.c_str());
+        else if(arg == "--size") opt.size = strtoul(value.c_str(), NULL, 10);
+        else if(arg == "--bcast-rate") opt.bcastRate = atof(value.c_str());
+        else if(arg == "--duration") opt.duration = atoi(value.c_str());
+        else if(arg == "--io-threads") opt.ioThreads = atoi(value.c_str());
+        else if(arg == "--workers") opt.workers = atoi(value.c_str());
+        else if(arg == "--server-pid") opt.serverPid = atoi(value.c_str());
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    raise_fd_limit();
+    //server diagnostics go to stderr through the async queue, never from the network threads directly
+    logger::getInstance()->init(NULL, 2, 8192, 50000000, 10000);
+
+    WebSocketServer wsServer("/bench");
+    std::thread serverTh;
+    if(opt.mode != "client")
+    {
+        //echo 'E' messages to the sender, fan 'B' messages out to every connection
+        wsServer.set_worker_threads(opt.workers);
+        wsServer.set_message_handler([&wsServer](ConnectionTask& task, server::message_ptr msg) {
+            const std::string &payload = msg->get_payload();
+            if(!payload.empty() && payload[0] == 'B')
+                wsServer.boardcast(payload);
+            else
+                wsServer.reply(task, payload);
+        });
+        serverTh = std::thread([&wsServer, &opt]() { wsServer.start(opt.port); });
+        usleep(200000);
+    }
+
+    if(opt.mode == "server")
+    {
+        printf("server pid %d, run the load generator with --mode client --server-pid %d\n", (int)getpid(), (int)getpid());
+        while(true)
+        {
+            ServerMetrics metrics = wsServer.get_metrics();
+            printf("connections %llu, in %llu msgs, out %llu msgs, loop lag p99 %lluus, VmRSS %s, Threads %s\n",
+                   (unsigned long long)metrics.connectionsActive, (unsigned long long)metrics.messagesIn,
+                   (unsigned long long)metrics.messagesOut, (unsigned long long)metrics.loopLag.p99,
+                   proc_status(0, "VmRSS").c_str(), proc_status(0, "Threads").c_str());
+            sleep(1);
+        }
+    }
+
+    LoadGenerator generator(opt);
+    generator.run();
+
+    if(serverTh.joinable())
+    {
+        wsServer.stop();
+        serverTh.join();
+    }
+    return 0;
+}
@@ -3,12 +3,40 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <functional>
 #include <websocketpp/client.hpp>
 #include <websocketpp/config/asio_client.hpp>
 #include <websocketpp/common/thread.hpp>
 #include <boost/asio.hpp>
+#include "../logger/logger.h"
 using client = websocketpp::client<websocketpp::config::asio_client>;
 
+inline logChannel *webSocketClientLog()
+{
+    static logChannel *channel = logger::getInstance()->getChannel("webSocketClient");
+    return channel;
+}
+
+/*
+WebSocketClient 每个对象独占一个client_和一个网络线程，适合少量连接
+WebSocketClientPool 多个连接共享一个io_service和固定数量的网络线程，connect返回AsyncWebSocketConnection
+AsyncWebSocketConnection:
+async_send 异步发送，消息在调用线程上直接放入websocketpp的发送队列，同一连接的消息按调用顺序发出；
+    回调或future表示的“完成”只是消息已进入websocketpp发送队列(或入队失败)，不代表已经写入socket
+receive 带超时接收，receive_batch 一次取出多条消息
+set_message_handler 设置后消息在网络线程直接回调，不再进入接收队列
+收到的消息以message_ptr形式交给调用者，不拷贝payload
+AsyncWebSocketConnection可以比WebSocketClientPool活得更久，pool析构时把所有连接置为关闭，之后的async_send直接以invalid_state错误回调
+*/
+
 class WebSocketClient {
     public:
         WebSocketClient(const std::string& uri) : uri_(uri), isConnected_(false)
@@ -34,13 +62,13 @@ class WebSocketClient {
             if (!isConnected_)
             {
                 websocketpp::lib::error_code errorCode;
-                std::cout << "uri = " << uri_ << std::endl;
+                LOGM_DEBUG(webSocketClientLog(), "event=connect uri=%s", uri_.c_str())
                 // 尝试连接到指定的URI
                 client::connection_ptr connection = client_.get_connection(uri_, errorCode);
 
                 if (errorCode)
                 {
-                    std::cout << "connect to" << uri_ << "failure: " << errorCode.message() << std::endl;
+                    LOGM_ERROR(webSocketClientLog(), "event=connect_failed uri=%s error=%s", uri_.c_str(), errorCode.message().c_str())
                     return;
                 }
 
@@ -151,4 +179,235 @@ class WebSocketClient {
             cv_.notify_all();
         }
 };
+
+class AsyncWebSocketConnection
+{
+    public:
+        typedef std::function<void(const websocketpp::lib::error_code&)> send_handler;
+        typedef std::function<void(client::message_ptr)> message_handler;
+
+        AsyncWebSocketConnection(client *c) : client_(c), state_(CONNECTING)
+        {
+        }
+
+        //wait for the handshake, timeoutMs < 0 waits forever
+        bool wait_connected(int timeoutMs = -1)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto ready = [this]() { return state_ != CONNECTING; };
+            if(timeoutMs < 0)
+                cv_.wait(lock, ready);
+            else
+                cv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+            return state_ == OPEN;
+        }
+
+        bool is_connected()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            return state_ == OPEN;
+        }
+
+        //websocketpp's send is thread safe and only queues the frame, so queue it here under mutex_:
+        //sends of one connection keep their call order even when the pool runs several network threads.
+        //handler then runs on the calling thread, once the message is queued for writing (not yet written
+        //to the socket) or with the error, invalid_state once the pool is destroyed
+        void async_send(const std::string& message, send_handler handler, websocketpp::frame::opcode::value op = websocketpp::frame::opcode::text)
+        {
+            websocketpp::lib::error_code ec;
+            std::unique_lock<std::mutex> lock(mutex_);
+            if(!client_)
+                ec = websocketpp::error::make_error_code(websocketpp::error::invalid_state);
+            else
+                client_->send(connectionHandle_, message, op, ec);
+            lock.unlock();
+            if(handler)
+                handler(ec);
+        }
+
+        //the future is ready when this returns, see above for what completion means
+        std::future<websocketpp::lib::error_code> async_send(const std::string& message, websocketpp::frame::opcode::value op = websocketpp::frame::opcode::text)
+        {
+            std::shared_ptr<std::promise<websocketpp::lib::error_code> > done = std::make_shared<std::promise<websocketpp::lib::error_code> >();
+            async_send(message, [done](const websocketpp::lib::error_code& ec) {
+                done->set_value(ec);
+            }, op);
+            return done->get_future();
+        }
+
+        //deliver messages on the network thread instead of queueing them, earlier messages stay queued
+        void set_message_handler(const message_handler& handler)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            handler_ = handler;
+        }
+
+        //timeoutMs < 0 waits forever, returns false on timeout or when closed with nothing queued
+        bool receive(client::message_ptr& message, int timeoutMs = -1)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if(!wait_message(lock, timeoutMs))
+                return false;
+            message = receivedMessages_.front();
+            receivedMessages_.pop_front();
+            return true;
+        }
+
+        //append up to max queued messages to messages, waiting at most timeoutMs for the first one
+        size_t receive_batch(std::vector<client::message_ptr>& messages, size_t max, int timeoutMs = 0)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if(!wait_message(lock, timeoutMs))
+                return 0;
+            size_t n = 0;
+            while(n < max && !receivedMessages_.empty())
+            {
+                messages.push_back(receivedMessages_.front());
+                receivedMessages_.pop_front();
+                ++n;
+            }
+            return n;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if(!client_)
+                return ;
+            websocketpp::lib::error_code ec;
+            client_->close(connectionHandle_, websocketpp::close::status::normal, "closing", ec);
+        }
+
+    private:
+        friend class WebSocketClientPool;
+        enum State { CONNECTING, OPEN, CLOSED };
+
+        client *client_;//cleared by ~WebSocketClientPool, guarded by mutex_
+        websocketpp::connection_hdl connectionHandle_;
+        State state_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        message_handler handler_;
+        std::deque<client::message_ptr> receivedMessages_;
+
+        bool wait_message(std::unique_lock<std::mutex>& lock, int timeoutMs)
+        {
+            auto ready = [this]() { return !receivedMessages_.empty() || state_ == CLOSED; };
+            if(timeoutMs < 0)
+                cv_.wait(lock, ready);
+            else
+                cv_.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+            return !receivedMessages_.empty();
+        }
+
+        // 事件处理程序
+        void on_message(websocketpp::connection_hdl, client::message_ptr message)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if(handler_)
+            {
+                message_handler handler = handler_;
+                lock.unlock();
+                handler(message);
+                return ;
+            }
+            receivedMessages_.push_back(message);
+            cv_.notify_all();
+        }
+        void on_open(websocketpp::connection_hdl)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            state_ = OPEN;
+            cv_.notify_all();
+        }
+        void on_close(websocketpp::connection_hdl)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            state_ = CLOSED;
+            cv_.notify_all();
+        }
+};
+
+class WebSocketClientPool
+{
+    public:
+        WebSocketClientPool(int threads = 1)
+        {
+            client_.init_asio(&ios_);
+            client_.set_access_channels(websocketpp::log::alevel::none);
+            client_.set_error_channels(websocketpp::log::elevel::none);
+            //keep run() alive while no connection exists
+            client_.start_perpetual();
+            for(int i = 0; i < threads; i++)
+            {
+                threads_.emplace_back([this]() {
+                    client_.run();
+                });
+            }
+        }
+        ~WebSocketClientPool()
+        {
+            //connections handed out by connect may outlive the pool, cut them off from client_ first
+            std::unique_lock<std::mutex> lock(mutex_);
+            for(auto &weak : links_)
+            {
+                std::shared_ptr<AsyncWebSocketConnection> link = weak.lock();
+                if(!link)
+                    continue;
+                std::unique_lock<std::mutex> linkLock(link->mutex_);
+                link->client_ = NULL;
+                link->state_ = AsyncWebSocketConnection::CLOSED;
+                link->cv_.notify_all();
+            }
+            links_.clear();
+            lock.unlock();
+            client_.stop_perpetual();
+            client_.stop();
+            for(auto &th : threads_)
+            {
+                th.join();
+            }
+        }
+
+        //starts the handshake and returns at once, use wait_connected to block
+        std::shared_ptr<AsyncWebSocketConnection> connect(const std::string& uri)
+        {
+            websocketpp::lib::error_code errorCode;
+            client::connection_ptr connection = client_.get_connection(uri, errorCode);
+            if (errorCode)
+            {
+                LOGM_ERROR(webSocketClientLog(), "event=connect_failed uri=%s error=%s", uri.c_str(), errorCode.message().c_str())
+                return std::shared_ptr<AsyncWebSocketConnection>();
+            }
+            std::shared_ptr<AsyncWebSocketConnection> link = std::make_shared<AsyncWebSocketConnection>(&client_);
+            link->connectionHandle_ = connection->get_handle();
+            connection->set_message_handler(std::bind(&AsyncWebSocketConnection::on_message, link, std::placeholders::_1, std::placeholders::_2));
+            connection->set_open_handler(std::bind(&AsyncWebSocketConnection::on_open, link, std::placeholders::_1));
+            connection->set_close_handler(std::bind(&AsyncWebSocketConnection::on_close, link, std::placeholders::_1));
+            connection->set_fail_handler(std::bind(&AsyncWebSocketConnection::on_close, link, std::placeholders::_1));
+            client_.connect(connection);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            //forget connections the caller already released
+            for(size_t i = 0; i < links_.size(); )
+            {
+                if(links_[i].expired())
+                {
+                    links_[i] = links_.back();
+                    links_.pop_back();
+                }
+                else
+                    i++;
+            }
+            links_.push_back(link);
+            return link;
+        }
+
+    private:
+        boost::asio::io_service ios_;
+        client client_;
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;//guards links_
+        std::vector<std::weak_ptr<AsyncWebSocketConnection> > links_;
+};
 #endif
@@ -8,9 +8,26 @@
 #include <thread>
 #include <atomic>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
 #include <mutex>
 #include <condition_variable>
 #include <unistd.h>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include "../ThreadPool/posixThreadPool.hpp"
+#include "latencyHistogram.hpp"
+#include "../logger/logger.h"
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+#include <zlib.h>
+#include <string.h>
+#include <stdlib.h>
+#endif
 
 /*
 ʵ¹ܣ
@@ -23,14 +40,374 @@ set_path 
 boardcast ӷϢ
 
 m_message_queuesΪÿάһУm_cvʵϢ
+ÿϢֽ(set_queue_limits)ٿͻ˳ʱԴ
+    DropOldest ɵϢConflate ͬһkeyֻϢDisconnect Ͽ
+߳ÿȡȫϢwebsocketppÿϢǶһ֡websocketppǺϲΪٵsocketд
+̰߳ȡϢͶݵ̷߳ͣsendwebsocketppͻļ鶼߳ϽУ
+websocketppڲͻ峬ֽʱֹ߳ͣȡϢûѹ޵Ķ
+߳ȷϻ彵ºͨm_cvѷ߳
+get_slow_consumer_stats ٿͻͳ
+
+set_message_handler עϢset_worker_threads posixThreadPool߳(0ʾֱ߳Ӵ)
+ÿһConnectionTaskյϢ(message_ptrpayload)ԼĶУ
+ͬһʱֻһ̴߳ͬһӵĶУ֤ͬһӵϢ˳
+ͨreplyظظͶݵӵstrand̷߳
+
+WEBSOCKET_PERMESSAGE_DEFLATE֧permessage-deflateѹ(Ҫzlib)
+set_global_deflate_optionsѹǽ̼ģͬһWebSocketServerãֻӰ֮Э̵
+Эserver_no_context_takeoverӣ㲥ϢڴСֻѹһΣѹ֡ӹ
+maxDeflateConnectionsͬʱѹӲѹԴÿzlib״̬ռõڴ
+
+get_metrics ָգӽ/رʧշϢֽͶȡ
+Ŷӳٺ¼ѭӳٷֲ(Ϣ/ֽ)ԭӱ·Ϳնȡȫ
+max_queue_depth һοӶдﵽȣֻṩֵгӵĶ
+set_metrics_path ú󣬱(ػַ)Ը·ͨHTTP GET󷵻ıʽָ꣬ͬһasioѭ
+·ͨHTTPδʱһ426Ǳ󷵻403
+
+ϢдloggerwebSocketServerͨ(ʽ event=... conn=...)ʹʱҪͬʱ../logger/logger.cpp
+logger::setModuleLevellogger첽зʽʼʱ̺߳ͷ̲߳ͬնIO
+init֮ǰļ¼ȻloggerУ߳дն
 
 
 m_connections Ϊÿάһint޸Ϊṹ壬ÿӴضĲ˴Ƿ
 
 */
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+struct DeflateOptions
+{
+    bool enabled = true;
+    int level = 6;//zlib level of the shared broadcast frames, websocketpp always uses the zlib default per connection
+    int serverMaxWindowBits = 15;//9..15, smaller windows use less memory per connection
+    bool serverNoContextTakeover = true;//required to share compressed broadcast frames
+    bool clientNoContextTakeover = false;
+    size_t maxDeflateConnections = 10000;//connections beyond this negotiate without compression
+};
+
+//process wide because websocketpp default-constructs one extension object per connection
+struct DeflateSettings
+{
+    std::mutex mt;
+    DeflateOptions options;
+    std::atomic<size_t> connections;//connections currently holding zlib state
+
+    DeflateSettings() : connections(0)
+    {
+    }
+};
+
+inline DeflateSettings& deflate_settings()
+{
+    static DeflateSettings settings;
+    return settings;
+}
+
+//process wide, shared by every WebSocketServer in the process, applies to connections negotiated after the call
+inline void set_global_deflate_options(const DeflateOptions& options)
+{
+    DeflateSettings &settings = deflate_settings();
+    std::unique_lock<std::mutex> lock(settings.mt);
+    settings.options = options;
+    if(settings.options.serverMaxWindowBits < 9)
+        settings.options.serverMaxWindowBits = 9;
+    if(settings.options.serverMaxWindowBits > 15)
+        settings.options.serverMaxWindowBits = 15;
+}
+
+//websocketpp's permessage-deflate with our options applied and a cap on how many connections hold zlib state
+template <typename config>
+class BoundedDeflate : public websocketpp::extensions::permessage_deflate::enabled<config>
+{
+    typedef websocketpp::extensions::permessage_deflate::enabled<config> base;
+public:
+    BoundedDeflate() : m_counted(false)
+    {
+    }
+
+    ~BoundedDeflate()
+    {
+        if(m_counted)
+            --deflate_settings().connections;
+    }
+
+    //hides base::negotiate, the hybi13 processor calls it on this exact type
+    std::pair<websocketpp::lib::error_code, std::string> negotiate(websocketpp::http::attribute_list const & offer)
+    {
+        namespace pmd = websocketpp::extensions::permessage_deflate;
+        DeflateSettings &settings = deflate_settings();
+        std::unique_lock<std::mutex> lock(settings.mt);
+        DeflateOptions options = settings.options;
+        lock.unlock();
+
+        std::pair<websocketpp::lib::error_code, std::string> ret;
+        ret.first = pmd::error::make_error_code(pmd::error::general);
+        if(!options.enabled || m_counted)
+            return ret;
+        if(settings.connections.fetch_add(1) >= options.maxDeflateConnections)
+        {
+            --settings.connections;
+            return ret;
+        }
+        if(options.serverNoContextTakeover)
+            base::enable_server_no_context_takeover();
+        if(options.clientNoContextTakeover)
+            base::enable_client_no_context_takeover();
+        base::set_server_max_window_bits(options.serverMaxWindowBits, pmd::mode::smallest);
+
+        ret = base::negotiate(offer);
+        if(ret.first)
+            --settings.connections;
+        else
+            m_counted = true;
+        return ret;
+    }
+
+private:
+    bool m_counted;
+};
+
+struct DeflateConfig : public websocketpp::config::asio
+{
+    typedef DeflateConfig type;
+    struct permessage_deflate_config {};
+    typedef BoundedDeflate<permessage_deflate_config> permessage_deflate_type;
+};
+
+typedef websocketpp::server<DeflateConfig> server;
+
+//compresses a broadcast payload once per window size, one zlib stream per window so memory stays fixed
+class SharedDeflate
+{
+public:
+    SharedDeflate()
+    {
+    }
+
+    ~SharedDeflate()
+    {
+        for(auto &zs : m_streams)
+        {
+            if(zs.second.ready)
+                deflateEnd(&zs.second.stream);
+        }
+    }
+
+    //raw deflate of payload with the trailing 00 00 ff ff removed, as permessage-deflate wants it
+    bool compress(const std::string& payload, int windowBits, int level, std::string& out)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        //zlib keeps a pointer back to the z_stream, so it is initialized in place and never copied
+        ZStream &zs = m_streams[windowBits];
+        if(zs.ready && zs.level != level)
+        {
+            deflateEnd(&zs.stream);
+            zs.ready = false;
+        }
+        if(!zs.ready)
+        {
+            memset(&zs.stream, 0, sizeof(zs.stream));
+            if(deflateInit2(&zs.stream, level, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+            zs.ready = true;
+            zs.level = level;
+        }
+        z_stream &stream = zs.stream;
+        //no context takeover: every message starts from an empty window
+        deflateReset(&stream);
+
+        out.resize(deflateBound(&stream, payload.size()) + 16);
+        stream.next_in = (Bytef *)payload.data();
+        stream.avail_in = payload.size();
+        stream.next_out = (Bytef *)&out[0];
+        stream.avail_out = out.size();
+        if(deflate(&stream, Z_SYNC_FLUSH) != Z_OK || stream.avail_in != 0)
+            return false;
+        out.resize(out.size() - stream.avail_out);
+        if(out.size() >= 4)
+            out.resize(out.size() - 4);
+        return true;
+    }
+
+private:
+    struct ZStream
+    {
+        z_stream stream;
+        bool ready = false;
+        int level = 0;
+    };
+    std::mutex m_mutex;
+    std::map<int, ZStream> m_streams;
+};
+#else
 typedef websocketpp::server<websocketpp::config::asio> server;
+#endif
 using namespace boost::asio;
 
+inline logChannel *webSocketServerLog()
+{
+    static logChannel *channel = logger::getInstance()->getChannel("webSocketServer");
+    return channel;
+}
+
+//what to do when a connection's send queue exceeds its limits
+enum class OverflowPolicy
+{
+    DropOldest,//discard the oldest queued messages
+    Conflate,//keep only the latest message per key, keyless messages fall back to DropOldest
+    Disconnect//close the slow connection
+};
+
+struct SendQueueLimits
+{
+    size_t maxMessages = 1024;
+    size_t maxBytes = 4 * 1024 * 1024;
+    OverflowPolicy policy = OverflowPolicy::DropOldest;
+};
+
+struct SlowConsumerStats
+{
+    uint64_t events = 0;//times a queue went over its limits
+    uint64_t dropped = 0;
+    uint64_t conflated = 0;//same-key replacements while the queue was over its limits
+    uint64_t disconnected = 0;
+};
+
+struct QueuedMessage
+{
+    std::string key;//only used by OverflowPolicy::Conflate
+    std::string payload;
+    server::message_ptr prepared;//already framed (compressed broadcast), shared between connections, payload is empty
+    std::chrono::steady_clock::time_point enqueued;//set by push_message, for the send latency histogram
+
+    size_t size() const
+    {
+        return prepared ? prepared->get_payload().size() : payload.size();
+    }
+};
+
+struct ConnectionQueue
+{
+    std::deque<QueuedMessage> messages;
+    size_t bytes = 0;
+    bool slow = false;//over limits since the last time the queue was drained
+    bool blocked = false;//a batch is on its way to websocketpp or its buffer is still over the limit, the sender waits
+    int deflateWindow = 0;//negotiated server window when compressed broadcast frames can be shared, 0 otherwise
+    //queued or taken by the sender but not yet handed to websocketpp, read by reply() without m_mutex
+    std::shared_ptr<std::atomic<size_t> > pending = std::make_shared<std::atomic<size_t> >(0);
+};
+
+//connection-affine task queue, appended to posixThreadPool as a whole so one connection's messages never run concurrently
+class ConnectionTask
+{
+public:
+    typedef std::function<void(ConnectionTask&, server::message_ptr)> handler;
+
+    ConnectionTask(websocketpp::connection_hdl hdl, io_service& ios, const handler& h, const std::shared_ptr<std::atomic<size_t> >& pending)
+        : m_hdl(hdl), m_strand(ios), m_handler(h), m_scheduled(false), m_pending(pending)
+    {
+    }
+
+    websocketpp::connection_hdl get_handle() const
+    {
+        return m_hdl;
+    }
+
+    //the connection's ConnectionQueue::pending counter
+    std::shared_ptr<std::atomic<size_t> > get_pending() const
+    {
+        return m_pending;
+    }
+
+    //a throwing handler must not unwind into the worker or websocketpp's read loop
+    void run_handler(server::message_ptr msg)
+    {
+        try
+        {
+            m_handler(*this, msg);
+        }
+        catch (std::exception const & e)
+        {
+            LOGM_ERROR(webSocketServerLog(), "event=handler_exception conn=%p what=%s", m_hdl.lock().get(), e.what())
+        }
+    }
+
+    //run f on the network thread, serialized with everything else posted for this connection
+    void post(const std::function<void()>& f)
+    {
+        m_strand.post(f);
+    }
+
+    //queue one inbound message, returns true when the task has to be appended to the pool
+    bool push(server::message_ptr msg, const std::shared_ptr<ConnectionTask>& self)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_messages.push(msg);
+        if(m_scheduled)
+            return false;
+        m_scheduled = true;
+        //keep the task alive while it sits in the pool, the pool only stores raw pointers
+        m_self = self;
+        return true;
+    }
+
+    //called by posixThreadPool worker
+    void process()
+    {
+        while(true)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if(m_messages.empty())
+            {
+                m_scheduled = false;
+                std::shared_ptr<ConnectionTask> self = std::move(m_self);
+                lock.unlock();
+                //self may be the last reference, nothing touches this after return
+                return ;
+            }
+            server::message_ptr msg = m_messages.front();
+            m_messages.pop();
+            lock.unlock();
+
+            run_handler(msg);
+        }
+    }
+
+private:
+    websocketpp::connection_hdl m_hdl;
+    io_service::strand m_strand;
+    handler m_handler;
+    std::mutex m_mutex;
+    std::queue<server::message_ptr> m_messages;
+    bool m_scheduled;
+    std::shared_ptr<ConnectionTask> m_self;
+    std::shared_ptr<std::atomic<size_t> > m_pending;
+};
+
+struct LatencySummary
+{
+    uint64_t count = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t max = 0;//microseconds
+};
+
+struct ServerMetrics
+{
+    uint64_t connectionsOpened = 0;
+    uint64_t connectionsClosed = 0;
+    uint64_t connectionsActive = 0;
+    uint64_t handshakeFailures = 0;//failed handshakes and wrong-path rejections
+    uint64_t messagesIn = 0;
+    uint64_t bytesIn = 0;
+    uint64_t messagesOut = 0;
+    uint64_t bytesOut = 0;
+    uint64_t queuedMessages = 0;//sum over all send queues
+    uint64_t queuedBytes = 0;
+    uint64_t maxQueueDepth = 0;//deepest single send queue since the previous get_metrics
+    SlowConsumerStats slowConsumers;
+    LatencySummary sendLatency;//enqueue to hand-off to websocketpp
+    LatencySummary loopLag;//how late the loop runs a timer that should fire every 100ms
+};
+
 struct CompareConnectionHdl
 {
     bool operator()(const websocketpp::connection_hdl& lhs,
@@ -43,8 +420,13 @@ struct CompareConnectionHdl
 class WebSocketServer
 {
 public:
+    typedef ConnectionTask::handler message_handler;
+
     WebSocketServer(const std::string& path = "")
-        : m_path(path), _running(0)
+        : m_path(path), _running(0), m_slowEvents(0), m_slowDropped(0), m_slowConflated(0), m_slowDisconnected(0),
+          m_workers(0), m_bufferedLimit(m_limits.maxBytes),
+          m_opened(0), m_closed(0), m_handshakeFailures(0), m_messagesIn(0), m_bytesIn(0), m_messagesOut(0), m_bytesOut(0),
+          m_queuedMessages(0), m_queuedBytes(0), m_queuePeak(0)
     {
         //debug log switch
         m_server.set_access_channels(websocketpp::log::alevel::none);
@@ -52,6 +434,8 @@ public:
         m_server.set_open_handler(std::bind(   &WebSocketServer::on_open, this, std::placeholders::_1));
         m_server.set_message_handler(std::bind(&WebSocketServer::on_message, this, std::placeholders::_1, std::placeholders::_2));
         m_server.set_close_handler(std::bind(   &WebSocketServer::on_close, this, std::placeholders::_1));
+        m_server.set_fail_handler(std::bind(    &WebSocketServer::on_fail, this, std::placeholders::_1));
+        m_server.set_http_handler(std::bind(    &WebSocketServer::on_http, this, std::placeholders::_1));
     }
 
     void start(int port)
@@ -62,21 +446,109 @@ public:
         m_server.start_accept();
         // start the ASIO io_service run loop
         _running = 1;
-        #if 1//how many clients are connecting to server?
-        std::thread debugTh([&, this]() {
-            int index = 0;
-            while(1)
+        m_lagTimer.reset(new steady_timer(m_server.get_io_service()));
+        arm_lag_timer();
+        if(m_workers > 0)
+        {
+            m_pool.reset(new posixThreadPool<ConnectionTask>(m_workers));
+        }
+        m_server.run();//block
+        //no more dispatch once the loop has returned, join the workers here.
+        //they run every task still queued first, so each ConnectionTask drops its self reference and queued messages
+        m_pool.reset();
+        m_lagTimer.reset();
+    }
+
+    ServerMetrics get_metrics()
+    {
+        ServerMetrics metrics;
+        metrics.connectionsOpened = m_opened.load(std::memory_order_relaxed);
+        metrics.connectionsClosed = m_closed.load(std::memory_order_relaxed);
+        metrics.connectionsActive = metrics.connectionsOpened - metrics.connectionsClosed;
+        metrics.handshakeFailures = m_handshakeFailures.load(std::memory_order_relaxed);
+        metrics.messagesIn = m_messagesIn.load(std::memory_order_relaxed);
+        metrics.bytesIn = m_bytesIn.load(std::memory_order_relaxed);
+        metrics.messagesOut = m_messagesOut.load(std::memory_order_relaxed);
+        metrics.bytesOut = m_bytesOut.load(std::memory_order_relaxed);
+        metrics.sendLatency = summarize(m_sendLatency);
+        metrics.loopLag = summarize(m_loopLag);
+        //runs on the network thread for the metrics endpoint, never waits for m_mutex
+        metrics.queuedMessages = m_queuedMessages.load(std::memory_order_relaxed);
+        metrics.queuedBytes = m_queuedBytes.load(std::memory_order_relaxed);
+        metrics.maxQueueDepth = m_queuePeak.exchange(0, std::memory_order_relaxed);
+        metrics.slowConsumers = get_slow_consumer_stats();
+        return metrics;
+    }
+
+    //plain "name value" lines, what the metrics endpoint serves
+    std::string get_metrics_text()
+    {
+        ServerMetrics m = get_metrics();
+        std::ostringstream out;
+        out << "connections_opened " << m.connectionsOpened << "\n"
+            << "connections_closed " << m.connectionsClosed << "\n"
+            << "connections_active " << m.connectionsActive << "\n"
+            << "handshake_failures " << m.handshakeFailures << "\n"
+            << "messages_in " << m.messagesIn << "\n"
+            << "bytes_in " << m.bytesIn << "\n"
+            << "messages_out " << m.messagesOut << "\n"
+            << "bytes_out " << m.bytesOut << "\n"
+            << "queued_messages " << m.queuedMessages << "\n"
+            << "queued_bytes " << m.queuedBytes << "\n"
+            << "max_queue_depth " << m.maxQueueDepth << "\n"
+            << "slow_consumer_events " << m.slowConsumers.events << "\n"
+            << "slow_consumer_dropped " << m.slowConsumers.dropped << "\n"
+            << "slow_consumer_conflated " << m.slowConsumers.conflated << "\n"
+            << "slow_consumer_disconnected " << m.slowConsumers.disconnected << "\n";
+        write_summary(out, "send_latency_us", m.sendLatency);
+        write_summary(out, "loop_lag_us", m.loopLag);
+        return out.str();
+    }
+
+    //must be called before start, serve get_metrics_text to loopback HTTP GETs of path on the websocket port, empty disables it
+    void set_metrics_path(const std::string& path)
+    {
+        m_metricsPath = path;
+    }
+
+    //must be called before start, handlers run on the pool workers when set_worker_threads > 0
+    void set_message_handler(const message_handler& handler)
+    {
+        m_handler = handler;
+    }
+
+    void set_worker_threads(int number)
+    {
+        m_workers = number;
+    }
+
+    //reply from a message handler, the send is posted to the connection's strand
+    void reply(ConnectionTask& task, const std::string& msg)
+    {
+        websocketpp::connection_hdl hdl = task.get_handle();
+        std::shared_ptr<std::atomic<size_t> > pending = task.get_pending();
+        std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+        task.post([this, hdl, msg, pending, posted]() {
+            websocketpp::lib::error_code ec;
+            server::connection_ptr con = m_server.get_con_from_hdl(hdl, ec);
+            if(ec)
+                return ;
+            //client is not keeping up, go through the bounded queue instead.
+            //while anything is still queued for this connection later replies queue too, so they cannot overtake it
+            if(*pending > 0 || con->get_buffered_amount() >= m_bufferedLimit)
             {
-                std::unique_lock<std::mutex> lock(m_mutex);
-                std::cout << "current link nums: " << m_connections.size() << std::endl;
-                lock.unlock();
-                sleep(3);
+                send(hdl, msg);
+                return ;
             }
+            ec = con->send(msg, websocketpp::frame::opcode::text);
+            if(ec)
+            {
+                LOGM_ERROR(webSocketServerLog(), "event=reply_error conn=%p error=%s", hdl.lock().get(), ec.message().c_str())
+                return ;
+            }
+            count_out(msg.size());
+            m_sendLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - posted).count());
         });
-
-        debugTh.detach();
-        #endif
-        m_server.run();//block
     }
 
     void stop()
@@ -98,52 +570,301 @@ public:
         //clear container
         m_connections.clear();
         m_message_queues.clear();
+        m_queuedMessages = 0;
+        m_queuedBytes = 0;
     }
 
     void send(websocketpp::connection_hdl hdl, const std::string& msg)
+    {
+        send(hdl, msg, "");
+    }
+
+    //messages with the same non-empty key replace each other under OverflowPolicy::Conflate
+    void send(websocketpp::connection_hdl hdl, const std::string& msg, const std::string& key)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
         if(0 == _running)
             return;
 
         // send msg to one client
-        m_message_queues[hdl].push(msg);
+        push_message(hdl, QueuedMessage{key, msg, server::message_ptr(), std::chrono::steady_clock::time_point()});
         // notify all clients
         m_cv.notify_all();
     }
 
+    void set_queue_limits(const SendQueueLimits& limits)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_limits = limits;
+        m_bufferedLimit = limits.maxBytes;
+    }
+
+    SlowConsumerStats get_slow_consumer_stats()
+    {
+        SlowConsumerStats stats;
+        stats.events = m_slowEvents.load(std::memory_order_relaxed);
+        stats.dropped = m_slowDropped.load(std::memory_order_relaxed);
+        stats.conflated = m_slowConflated.load(std::memory_order_relaxed);
+        stats.disconnected = m_slowDisconnected.load(std::memory_order_relaxed);
+        return stats;
+    }
+
     void set_path(const std::string& path)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
         m_path = path;
     }
 	//send message to all clients
-    bool boardcast(std::string msg)
+    bool boardcast(std::string msg, const std::string& key = "")
     {
         std::unique_lock<std::mutex> lock(m_mutex);
 
         if(0 == _running)
             return false;
 
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+        //compress once per negotiated window outside the lock, every connection of a window shares the frame
+        std::map<int, server::message_ptr> frames;
+        for(auto &queue : m_message_queues)
+        {
+            if(queue.second.deflateWindow)
+                frames[queue.second.deflateWindow];
+        }
+        if(!frames.empty())
+        {
+            lock.unlock();
+            for(auto &frame : frames)
+            {
+                frame.second = prepare_deflate_frame(msg, frame.first);
+            }
+            lock.lock();
+            if(0 == _running)
+                return false;
+        }
+#endif
         for(auto &conn : m_connections)
         {
+            if(conn.second)
             {
-                m_message_queues[conn.first].push(msg);
-                m_cv.notify_all();
+                QueuedMessage queued{key, msg, server::message_ptr(), std::chrono::steady_clock::time_point()};
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+                auto it = m_message_queues.find(conn.first);
+                if(it != m_message_queues.end() && it->second.deflateWindow && frames[it->second.deflateWindow])
+                {
+                    queued.payload.clear();
+                    queued.prepared = frames[it->second.deflateWindow];
+                }
+#endif
+                push_message(conn.first, std::move(queued));
             }
         }
+        m_cv.notify_all();
         return true;
     }
 
 private:
     server m_server;
     std::map<websocketpp::connection_hdl, int, CompareConnectionHdl> m_connections;
-    std::map<websocketpp::connection_hdl, std::queue<std::string>, CompareConnectionHdl> m_message_queues;
+    std::map<websocketpp::connection_hdl, ConnectionQueue, CompareConnectionHdl> m_message_queues;
     std::mutex m_mutex;
     std::condition_variable m_cv;
     //connection need verify m_path and (ipAddr or deviceId or systemId), use constructor or method to init them.
     std::string m_path;
-    int _running;
+    std::atomic<int> _running;//read by the network thread and the senders without m_mutex
+    SendQueueLimits m_limits;
+    //slow consumer counters, written under m_mutex, read by get_slow_consumer_stats without it
+    std::atomic<uint64_t> m_slowEvents;
+    std::atomic<uint64_t> m_slowDropped;
+    std::atomic<uint64_t> m_slowConflated;
+    std::atomic<uint64_t> m_slowDisconnected;
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+    SharedDeflate m_deflate;
+
+    //build a ready-to-write compressed text frame, server frames are unmasked so any connection can send it
+    server::message_ptr prepare_deflate_frame(const std::string& payload, int windowBits)
+    {
+        std::unique_lock<std::mutex> lock(deflate_settings().mt);
+        int level = deflate_settings().options.level;
+        lock.unlock();
+
+        std::string compressed;
+        if(!m_deflate.compress(payload, windowBits, level, compressed))
+            return server::message_ptr();
+        server::message_ptr frame = websocketpp::lib::make_shared<server::message_type>(
+            server::message_type::con_msg_man_ptr(), websocketpp::frame::opcode::text, 0);
+        websocketpp::frame::basic_header header(websocketpp::frame::opcode::text, compressed.size(), true, false, true);
+        websocketpp::frame::extended_header extended(compressed.size());
+        frame->set_header(websocketpp::frame::prepare_header(header, extended));
+        frame->set_payload(compressed);
+        frame->set_compressed(true);
+        frame->set_prepared(true);
+        return frame;
+    }
+
+    //window bits to share frames with, 0 when the connection has no deflate or keeps its compression context
+    int shared_deflate_window(server::connection_ptr con)
+    {
+        const std::string &ext = con->get_response_header("Sec-WebSocket-Extensions");
+        if(ext.find("permessage-deflate") == std::string::npos || ext.find("server_no_context_takeover") == std::string::npos)
+            return 0;
+        int window = 15;
+        size_t pos = ext.find("server_max_window_bits=");
+        if(pos != std::string::npos)
+            window = atoi(ext.c_str() + pos + strlen("server_max_window_bits="));
+        return (window >= 9 && window <= 15) ? window : 0;
+    }
+#endif
+    int m_workers;
+    std::atomic<size_t> m_bufferedLimit;//copy of m_limits.maxBytes readable from the network thread without m_mutex
+    message_handler m_handler;
+    std::unique_ptr<posixThreadPool<ConnectionTask> > m_pool;
+    //metrics, updated without m_mutex
+    std::atomic<uint64_t> m_opened;
+    std::atomic<uint64_t> m_closed;
+    std::atomic<uint64_t> m_handshakeFailures;
+    std::atomic<uint64_t> m_messagesIn;
+    std::atomic<uint64_t> m_bytesIn;
+    std::atomic<uint64_t> m_messagesOut;
+    std::atomic<uint64_t> m_bytesOut;
+    //send queue totals kept next to every queue change so get_metrics needs no m_mutex
+    std::atomic<uint64_t> m_queuedMessages;
+    std::atomic<uint64_t> m_queuedBytes;
+    std::atomic<uint64_t> m_queuePeak;//deepest queue since the last get_metrics
+    LatencyHistogram m_sendLatency;
+    LatencyHistogram m_loopLag;
+    std::unique_ptr<steady_timer> m_lagTimer;
+    std::string m_metricsPath;//set before start, read by on_http without a lock
+
+    static LatencySummary summarize(const LatencyHistogram& h)
+    {
+        LatencySummary summary;
+        summary.count = h.count();
+        summary.p50 = h.percentile(50);
+        summary.p99 = h.percentile(99);
+        summary.max = h.max();
+        return summary;
+    }
+
+    static void write_summary(std::ostringstream& out, const char *name, const LatencySummary& s)
+    {
+        out << name << "_count " << s.count << "\n"
+            << name << "_p50 " << s.p50 << "\n"
+            << name << "_p99 " << s.p99 << "\n"
+            << name << "_max " << s.max << "\n";
+    }
+
+    //a timer that should fire every 100ms, how late it actually fires is the event loop lag
+    void arm_lag_timer()
+    {
+        std::chrono::steady_clock::time_point expected = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        m_lagTimer->expires_at(expected);
+        m_lagTimer->async_wait([this, expected](const boost::system::error_code& error) {
+            if(error)
+                return ;
+            m_loopLag.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - expected).count());
+            arm_lag_timer();
+        });
+    }
+
+    void count_out(size_t bytes)
+    {
+        m_messagesOut.fetch_add(1, std::memory_order_relaxed);
+        m_bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    //messages leaving the send queues, for the lock-free totals in get_metrics
+    void dequeued(size_t messages, size_t bytes)
+    {
+        m_queuedMessages.fetch_sub(messages, std::memory_order_relaxed);
+        m_queuedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    //enqueue one message and apply the overflow policy, m_mutex must be held
+    void push_message(websocketpp::connection_hdl hdl, QueuedMessage&& msg)
+    {
+        auto it = m_message_queues.find(hdl);
+        if(it == m_message_queues.end())
+            return;
+        ConnectionQueue &queue = it->second;
+
+        if(m_limits.policy == OverflowPolicy::Conflate && !msg.key.empty())
+        {
+            for(auto old = queue.messages.begin(); old != queue.messages.end(); ++old)
+            {
+                if(old->key == msg.key)
+                {
+                    queue.bytes -= old->size();
+                    dequeued(1, old->size());
+                    queue.messages.erase(old);
+                    --*queue.pending;
+                    //replacing a stale value is normal, only count it while the client is not keeping up
+                    if(queue.slow)
+                        ++m_slowConflated;
+                    break;
+                }
+            }
+        }
+        queue.bytes += msg.size();
+        msg.enqueued = std::chrono::steady_clock::now();
+        m_queuedMessages.fetch_add(1, std::memory_order_relaxed);
+        m_queuedBytes.fetch_add(msg.size(), std::memory_order_relaxed);
+        queue.messages.push_back(std::move(msg));
+        ++*queue.pending;
+        uint64_t depth = queue.messages.size();
+        uint64_t peak = m_queuePeak.load(std::memory_order_relaxed);
+        while(depth > peak && !m_queuePeak.compare_exchange_weak(peak, depth, std::memory_order_relaxed))
+        {
+        }
+
+        if(queue.messages.size() <= m_limits.maxMessages && queue.bytes <= m_limits.maxBytes)
+            return;
+
+        if(!queue.slow)
+        {
+            queue.slow = true;
+            ++m_slowEvents;
+            LOGM_WARN(webSocketServerLog(), "event=slow_consumer conn=%p msgs=%zu bytes=%zu", hdl.lock().get(), queue.messages.size(), queue.bytes)
+        }
+        if(m_limits.policy == OverflowPolicy::Disconnect)
+        {
+            websocketpp::lib::error_code ec;
+            ++m_slowDisconnected;
+            m_slowDropped += queue.messages.size();
+            dequeued(queue.messages.size(), queue.bytes);
+            *queue.pending -= queue.messages.size();
+            queue.messages.clear();
+            queue.bytes = 0;
+            m_server.close(hdl, websocketpp::close::status::try_again_later, "slow consumer", ec);
+            return;
+        }
+        //always keep the newest message even if it alone exceeds maxBytes
+        while(queue.messages.size() > 1 &&
+              (queue.messages.size() > m_limits.maxMessages || queue.bytes > m_limits.maxBytes))
+        {
+            queue.bytes -= queue.messages.front().size();
+            dequeued(1, queue.messages.front().size());
+            queue.messages.pop_front();
+            --*queue.pending;
+            ++m_slowDropped;
+        }
+    }
+
+    //move everything queued into batch, message boundaries are kept, m_mutex must be held.
+    //returns how many queued messages were taken, the caller subtracts them from pending once they are sent
+    size_t take_batch(ConnectionQueue& queue, std::vector<QueuedMessage>& batch)
+    {
+        size_t taken = queue.messages.size();
+        dequeued(taken, queue.bytes);
+        batch.reserve(taken);
+        for(auto &msg : queue.messages)
+        {
+            batch.push_back(std::move(msg));
+        }
+        queue.messages.clear();
+        queue.bytes = 0;
+        queue.slow = false;
+        return taken;
+    }
     void on_open(websocketpp::connection_hdl hdl)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
@@ -153,79 +874,184 @@ private:
         // disable client's wrong url
         if (request_path != m_path)
         {
+            m_handshakeFailures.fetch_add(1, std::memory_order_relaxed);
+            LOGM_WARN(webSocketServerLog(), "event=reject conn=%p path=%s", hdl.lock().get(), request_path.c_str())
             m_server.send(hdl, "wrong websocket url path", websocketpp::frame::opcode::text);
             m_server.close(hdl, websocketpp::close::status::policy_violation, "Invalid request path");
             return;
         }
         //init connection status
+        m_opened.fetch_add(1, std::memory_order_relaxed);
         m_connections[hdl] = 1;
-        m_message_queues[hdl] = std::queue<std::string>();
+        m_message_queues[hdl] = ConnectionQueue();
+#ifdef WEBSOCKET_PERMESSAGE_DEFLATE
+        m_message_queues[hdl].deflateWindow = shared_deflate_window(m_server.get_con_from_hdl(hdl));
+#endif
+        // inbound messages of this connection go straight to its own task queue, no global lock on the way
+        std::shared_ptr<ConnectionTask> task = std::make_shared<ConnectionTask>(hdl, m_server.get_io_service(), m_handler, m_message_queues[hdl].pending);
+        m_server.get_con_from_hdl(hdl)->set_message_handler(std::bind(&WebSocketServer::dispatch, this, task, std::placeholders::_1, std::placeholders::_2));
         // create a new thread for the new client
-        std::thread t([this, hdl]() {
+        std::shared_ptr<steady_timer> drain = std::make_shared<steady_timer>(m_server.get_io_service());
+        std::thread t([this, hdl, drain]() {
             while (true)
             {
                 std::unique_lock<std::mutex> lock(m_mutex);
                 // wait a new message from the queue.if condition is false, process will be blocked and release the lock here, otherwise get the lock and continue running.
+                // while blocked, websocketpp has not flushed what we already handed it and the backlog stays in the bounded queue
                 m_cv.wait(lock, [this, hdl]() {
-                        return (!m_connections[hdl] || !m_message_queues[hdl].empty() || !_running);
+                        return (!m_connections[hdl] || (!m_message_queues[hdl].messages.empty() && !m_message_queues[hdl].blocked) || !_running);
                 });
 
                 if(!_running)
                 {
-                    std::cout << "service has been stopped, thread exit!!!" << std::endl;
+                    LOGM_INFO(webSocketServerLog(), "event=sender_exit reason=server_stopped conn=%p", hdl.lock().get())
                     m_server.close(hdl, websocketpp::close::status::policy_violation, "server closed");
                     lock.unlock();
                     return ;
                 }
                 if(!m_connections[hdl])
                 {
-                    std::cout << "link has been closed\n";
+                    LOGM_DEBUG(webSocketServerLog(), "event=sender_exit reason=closed conn=%p", hdl.lock().get())
                     // delete an element from map
                     m_connections.erase(hdl);
                     // delete an element from map
+                    ConnectionQueue &queue = m_message_queues[hdl];
+                    dequeued(queue.messages.size(), queue.bytes);
                     m_message_queues.erase(hdl);
                     return ;
                 }
-                // get one msg from queue
-                std::string msg = m_message_queues[hdl].front();
-                m_message_queues[hdl].pop();
+                // take every queued msg at once, websocketpp gathers them into as few socket writes as possible
+                std::shared_ptr<std::vector<QueuedMessage> > batch = std::make_shared<std::vector<QueuedMessage> >();
+                ConnectionQueue &queue = m_message_queues[hdl];
+                std::shared_ptr<std::atomic<size_t> > pending = queue.pending;
+                size_t taken = take_batch(queue, *batch);
+                queue.blocked = true;
 
                 //release lock
                 lock.unlock();
 
-                try
-                {
-                    // send message to client
-                    m_server.send(hdl, msg, websocketpp::frame::opcode::text);
-                }
-                catch (websocketpp::exception const & e)
-                {
-                    std::cerr << "WebSocketServer::on_open send exception: " << e.what() << std::endl;
-                }
+                // the network thread sends, so reply() and the buffered amount checks never race with this batch
+                m_server.get_io_service().post([this, hdl, batch, taken, pending, drain]() {
+                    flush_batch(hdl, *batch, taken, pending, drain);
+                });
             }
-            std::cout << "thread exit\n";
         });
         t.detach();
-        std::cout << "create a new thread\n";
+        LOGM_DEBUG(webSocketServerLog(), "event=open conn=%p path=%s", hdl.lock().get(), request_path.c_str())
+    }
+    //network thread only, hand a batch taken by the sender to websocketpp
+    void flush_batch(websocketpp::connection_hdl hdl, std::vector<QueuedMessage>& batch, size_t taken,
+                     std::shared_ptr<std::atomic<size_t> > pending, std::shared_ptr<steady_timer> drain)
+    {
+        websocketpp::lib::error_code ec;
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl, ec);
+        for(size_t i = 0; !ec && i < batch.size(); i++)
+        {
+            QueuedMessage &msg = batch[i];
+            // send message to client
+            if(msg.prepared)
+                ec = con->send(msg.prepared);
+            else
+                ec = con->send(msg.payload, websocketpp::frame::opcode::text);
+            if(ec)
+            {
+                LOGM_ERROR(webSocketServerLog(), "event=send_error conn=%p error=%s", hdl.lock().get(), ec.message().c_str())
+                break;
+            }
+            count_out(msg.size());
+            m_sendLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - msg.enqueued).count());
+        }
+        *pending -= taken;
+        wait_drained(hdl, drain);
+    }
+    //network thread only, unblock the sender once websocketpp's buffer for hdl is below the limit.
+    //websocketpp has no write completion callback, so recheck from the loop every millisecond while over it, without any lock
+    void wait_drained(websocketpp::connection_hdl hdl, std::shared_ptr<steady_timer> drain)
+    {
+        websocketpp::lib::error_code ec;
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl, ec);
+        if(!ec && _running && con->get_state() == websocketpp::session::state::open &&
+           con->get_buffered_amount() >= m_bufferedLimit)
+        {
+            drain->expires_after(std::chrono::milliseconds(1));
+            drain->async_wait([this, hdl, drain](const boost::system::error_code&) {
+                wait_drained(hdl, drain);
+            });
+            return ;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto it = m_message_queues.find(hdl);
+        if(it != m_message_queues.end())
+            it->second.blocked = false;
+        lock.unlock();
+        m_cv.notify_all();
     }
     //callback, when data arrives, this function will be called, the first arg is the connection handle, the second arg is the message.
     void on_message(websocketpp::connection_hdl hdl, server::message_ptr msg)
     {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        std::string payload =  msg->get_payload();
-        std::cout << "recv msg: " << payload << std::endl;
+        LOGM_DEBUG(webSocketServerLog(), "event=recv conn=%p bytes=%zu payload=%.*s", hdl.lock().get(), msg->get_payload().size(),
+                   (int)msg->get_payload().size(), msg->get_payload().data())
+    }
+    //per connection message callback installed in on_open
+    void dispatch(std::shared_ptr<ConnectionTask> task, websocketpp::connection_hdl hdl, server::message_ptr msg)
+    {
+        m_messagesIn.fetch_add(1, std::memory_order_relaxed);
+        m_bytesIn.fetch_add(msg->get_payload().size(), std::memory_order_relaxed);
+        if(!m_handler)
         {
-        //  m_connections[hdl] = payload;
+            on_message(hdl, msg);
+            return ;
+        }
+        if(!m_pool)
+        {
+            task->run_handler(msg);
+            return ;
+        }
+        if(task->push(msg, task))
+        {
+            m_pool->append(task.get());
         }
-
     }
     //callback, when a connection closed, this function will be called.
     void on_close(websocketpp::connection_hdl hdl)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
-        m_connections[hdl] = 0;
+        // connections rejected in on_open never had an entry
+        auto it = m_connections.find(hdl);
+        if(it == m_connections.end())
+            return ;
+        it->second = 0;
+        m_closed.fetch_add(1, std::memory_order_relaxed);
         m_cv.notify_all();
     }
+    //callback, when a handshake or the tcp connection fails before open
+    void on_fail(websocketpp::connection_hdl)
+    {
+        m_handshakeFailures.fetch_add(1, std::memory_order_relaxed);
+    }
+    //callback, plain http request (no websocket upgrade) on the listening port
+    void on_http(websocketpp::connection_hdl hdl)
+    {
+        server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+        const std::string &metricsPath = m_metricsPath;
+
+        //anything but the metrics path gets what websocketpp answers without an http handler
+        if(metricsPath.empty() || con->get_resource() != metricsPath)
+        {
+            con->set_status(websocketpp::http::status_code::upgrade_required);
+            return ;
+        }
+        boost::system::error_code ec;
+        bool local = con->get_raw_socket().remote_endpoint(ec).address().is_loopback();
+        if(ec || !local)
+        {
+            con->set_status(websocketpp::http::status_code::forbidden);
+            return ;
+        }
+        con->set_status(websocketpp::http::status_code::ok);
+        con->append_header("Content-Type", "text/plain");
+        con->set_body(get_metrics_text());
+    }
 };
 #endif
 